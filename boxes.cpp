@@ -4,12 +4,35 @@
 #include <set>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <functional>
+#include <chrono>
+#include <stdio.h>
 #include <time.h>
 
 #if defined(PLATFORM_WEB)
 #include <emscripten.h>
 #endif
 
+//Threads are always available on desktop, but on the web only in the pthreads build
+#if !defined(PLATFORM_WEB) || defined(__EMSCRIPTEN_PTHREADS__)
+#define HAS_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+//Threads which batch jobs are split across, counting the caller. On the web emscripten
+//can only start THREADPOOL threads up front, and the worker takes one of them.
+#if defined(PLATFORM_WEB)
+#if !defined(THREADPOOL)
+#define THREADPOOL 4
+#endif
+#define EVALUATORS (THREADPOOL - 1)
+#else
+#define EVALUATORS max(1u, thread::hardware_concurrency())
+#endif
+
 #define NUMCOLORS 8
 #define WIDTH 800
 #define SIDEBAR 200
@@ -26,6 +49,7 @@
 //#define FOREGROUND (Color){0x00, 0x11, 0x08, 0xff}
 #define HIGHLIGHT (Color){0, 0, 0, 127}
 #define MAXSYMBOLS 16
+#define MAXLEVELSIDE 16384  //Sanity cap on level files, checked before allocating
 #define BUTTONHEIGHT 24
 #define BUTTONMARGIN 8
 
@@ -67,15 +91,23 @@ struct box {
         opp = pos + dim - V2(1, 1);
     }
 
-    void write(vector<vector<char>>& colors) {
-        if (dim == V2(1, 1)) {
-            colors[pos.y][pos.x] = color;
-        }
-        else {
-            for (box* b : children) {
-                b -> write(colors);
+    //Color of the unit box at v, which must lie inside this box
+    char colorAt(V2 v) {
+        for (box* b : children) {
+            if (v.x >= b -> pos.x && v.x <= b -> opp.x && v.y >= b -> pos.y && v.y <= b -> opp.y) {
+                return b -> colorAt(v);
             }
         }
+        return color;
+    }
+
+    box* clone() {
+        box* copy = new box(*this);
+        copy -> children.clear();
+        for (box* b : children) {
+            copy -> children.insert(b -> clone());
+        }
+        return copy;
     }
 
     void deleteChildren() {
@@ -86,12 +118,278 @@ struct box {
     }
 };
 
+//Text which is measured once and re-measured only when it changes, so that
+//steady-state frames do no string building or text measurement.
+struct label {
+    string text;
+    int width = -1;     //Measured lazily, since the font isn't loaded until InitWindow
+
+    label(const char* newText = "") : text(newText) {}
+    label(string newText) : text(newText) {}
+
+    void set(const char* newText) {
+        if (text != newText) {
+            text = newText;
+            width = -1;
+        }
+    }
+
+    int measure() {
+        if (width < 0) {
+            width = MeasureText(text.c_str(), BUTTONHEIGHT);
+        }
+        return width;
+    }
+};
+
 struct symbol {
     unsigned char c;
     unsigned char color;
     V2 start, end;
 };
 
+//Unit box colors, packed two to a byte since every color fits in 4 bits
+struct packedColors {
+    int rows = 0, cols = 0;
+    vector<unsigned char> bytes;
+
+    void init(int newRows, int newCols) {
+        rows = newRows;
+        cols = newCols;
+        bytes = vector<unsigned char>(((size_t)rows * cols + 1) / 2, 0);
+    }
+
+    char get(int x, int y) {
+        size_t i = (size_t)y * cols + x;
+        return (bytes[i / 2] >> (4 * (i % 2))) & 0xf;
+    }
+
+    void set(int x, int y, char c) {
+        size_t i = (size_t)y * cols + x;
+        bytes[i / 2] = (bytes[i / 2] & (0xf0 >> (4 * (i % 2)))) | (c << (4 * (i % 2)));
+    }
+};
+
+//A level in its file form. Reading and writing stream one line at a time, so the
+//only full-size storage is the packed colors, however large the level is.
+struct levelType {
+    int rows = 0, cols = 0, numSymbols = 0;
+    string caption;
+    packedColors colors;
+    vector<symbol> symbols;
+
+    //Report malformed input with its line number and return false
+    bool read(istream& in, string fileName,
+              int maxRows = MAXLEVELSIDE, int maxCols = MAXLEVELSIDE) {
+        string line;
+        int lineNumber = 0;
+        auto fail = [&](string message) {
+            cerr << fileName << ":" << lineNumber << ": " << message << endl;
+            return false;
+        };
+        lineNumber++;
+        if (!getline(in, line)) {
+            return fail("missing header");
+        }
+        istringstream header(line);
+        if (!(header >> rows >> cols >> numSymbols)) {
+            return fail("header must start with rows, columns and symbols");
+        }
+        if (rows < 1 || cols < 1 || numSymbols < 0 || numSymbols > MAXSYMBOLS) {
+            return fail("bad board size or symbol count");
+        }
+        if (rows > maxRows || cols > maxCols) {
+            return fail("board larger than " + to_string(maxRows) + " x " + to_string(maxCols));
+        }
+        getline(header, caption);
+        if (!caption.empty() && caption[0] == ' ') {
+            caption.erase(0, 1);
+        }
+        colors.init(rows, cols);
+        for (int y = 0; y < rows; y++) {
+            lineNumber++;
+            if (!getline(in, line)) {
+                return fail("expected " + to_string(rows) + " rows of colors");
+            }
+            int x = 0;
+            for (char c : line) {
+                if (c == ' ' || c == '\t' || c == '\r') {
+                    continue;
+                }
+                if (c < '0' || c >= '0' + NUMCOLORS) {
+                    return fail(string("bad color '") + c + "'");
+                }
+                if (x == cols) {
+                    return fail("more than " + to_string(cols) + " colors in row");
+                }
+                colors.set(x++, y, c - '0');
+            }
+            if (x < cols) {
+                return fail("expected " + to_string(cols) + " colors in row, found " + to_string(x));
+            }
+        }
+        symbols = vector<symbol>(numSymbols, symbol());
+        vector<bool> seen(numSymbols, false);
+        for (symbol& s : symbols) {
+            lineNumber++;
+            if (!getline(in, line)) {
+                return fail("expected " + to_string(numSymbols) + " symbols");
+            }
+            istringstream symbolLine(line);
+            char c;
+            if (!(symbolLine >> c >> s.start.x >> s.start.y >> s.end.x >> s.end.y) ||
+                !(symbolLine >> ws).eof()) {
+                return fail("symbol must be a letter followed by start and end positions");
+            }
+            if (c < 'A' || c >= 'A' + numSymbols || seen[c - 'A']) {
+                return fail(string("bad or repeated symbol '") + c + "'");
+            }
+            for (V2 v : {s.start, s.end}) {
+                if (v.x < 0 || v.x >= cols || v.y < 0 || v.y >= rows) {
+                    return fail("symbol position outside board");
+                }
+            }
+            seen[c - 'A'] = true;
+            s.c = c - 'A';
+            s.color = colors.get(s.start.x, s.start.y);
+        }
+        while (getline(in, line)) {
+            lineNumber++;
+            if (line.find_first_not_of(" \t\r") != string::npos) {
+                return fail("unexpected text after symbols");
+            }
+        }
+        return true;
+    }
+
+    void write(ostream& out) {
+        //The caption must stay on the header line, so line breaks become spaces
+        out << rows << " " << cols << " " << numSymbols << " ";
+        for (char c : caption) {
+            out << (c == '\n' || c == '\r' ? ' ' : c);
+        }
+        out << endl;
+        for (int y = 0; y < rows; y++) {
+            for (int x = 0; x < cols; x++) {
+                out << char('0' + colors.get(x, y)) << " ";
+            }
+            out << endl;
+        }
+        for (symbol& s : symbols) {
+            out << char('A' + s.c) << " " << s.start.x << " " << s.start.y
+                << " " << s.end.x << " " << s.end.y << endl;
+        }
+    }
+};
+
+//Threads started once, which then share out each batch job with the calling thread.
+//Without threads, jobs run entirely on the caller.
+class poolType {
+
+    int numThreads = 0;
+#if defined(HAS_THREADS)
+    vector<thread> threads;
+    function<void(int, int)> job;
+    int generation = 0;
+    int remaining = 0;
+    bool quit = false;
+    mutex m;
+    condition_variable cv;
+
+    void run(int index) {
+        int seen = 0;
+        unique_lock<mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [&] {return quit || generation != seen;});
+            if (quit) {
+                return;
+            }
+            seen = generation;
+            function<void(int, int)> current = job;
+            lock.unlock();
+            current(index, numThreads + 1);
+            lock.lock();
+            if (--remaining == 0) {
+                cv.notify_all();
+            }
+        }
+    }
+#endif
+
+    public:
+
+    //Only start a pool where something will use it, and from the main thread, since on
+    //the web emscripten hands thread creation to the main thread
+    void start(int newNumThreads) {
+    #if defined(HAS_THREADS)
+        numThreads = max(0, newNumThreads);
+        for (int i = 1; i <= numThreads; i++) {
+            threads.emplace_back(&poolType::run, this, i);
+        }
+    #endif
+    }
+
+    //Threads a job is split across, counting the caller
+    int size() {
+        return numThreads + 1;
+    }
+
+    //Call newJob(index, count) once for each index below count, the caller taking index 0
+    void runAll(function<void(int, int)> newJob) {
+    #if defined(HAS_THREADS)
+        if (numThreads > 0) {
+            {
+                lock_guard<mutex> lock(m);
+                job = newJob;
+                remaining = numThreads;
+                generation++;
+                cv.notify_all();
+            }
+            newJob(0, numThreads + 1);
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [this] {return remaining == 0;});
+            job = nullptr;
+            return;
+        }
+    #endif
+        newJob(0, 1);
+    }
+
+    void stop() {
+    #if defined(HAS_THREADS)
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+            cv.notify_all();
+        }
+        for (thread& t : threads) {
+            t.join();
+        }
+        threads.clear();
+        numThreads = 0;
+    #endif
+    }
+};
+
+//Mouse press or release at a point on screen, recorded by the main loop every frame
+struct clickType {
+    int button;
+    bool pressed;
+    Vector2 at;
+};
+
+//Candidate combine of the rectangle from low to high, inclusive
+struct moveType {
+    V2 low, high;
+};
+
+struct moveResult {
+    bool legal = false;
+    char color = 0;                         //resultColor of the combined box
+    bool connected[MAXSYMBOLS] = {false};   //Indexed like symbols: start linked to end
+    bool won = false;
+};
+
 class boardType {
 
     char colorSelect = 0;
@@ -110,9 +408,12 @@ class boardType {
     };
 
     vector<symbol> symbols;
+    bool linked[MAXSYMBOLS] = {false};  //Indexed like symbols: start linked to end
     vector<vector<box*>> boxes;
     int rows = 0, cols = 0, numSymbols = 0;
     string caption;
+    vector<string> captionLines;
+    bool captionLaidOut = false;
     int grid, space;
     V2 p1, p2, low, high;
 
@@ -123,6 +424,7 @@ class boardType {
         cols = newCols;
         numSymbols = newNumSymbols;
         caption = newCaption;
+        captionLaidOut = false;
         boxes = vector<vector<box*>>(rows, vector<box*>(cols, NULL));
         symbols = vector<symbol>(numSymbols, symbol());
         for (int i = 0; i < symbols.size(); i++) {
@@ -161,29 +463,57 @@ class boardType {
     }
 
     //Read from file constructor
-    void read(string fileName) {
+    //Return false if the level is missing or malformed. This runs on the worker,
+    //so it must not exit() while the main thread still owns running threads.
+    bool read(string fileName) {
         ifstream in;
         in.open("resources/" + fileName);
         if (!in) {
             cerr << "Could not open level file " << fileName << endl;
-            exit(EXIT_FAILURE);
+            return false;
         }
-        in >> rows >> cols >> numSymbols;
-        getline(in, caption);
-        init(rows, cols, numSymbols, caption);
-        char c;
+        //Boards must fit on screen with at least MINGRID pixels per cell
+        levelType level;
+        if (!level.read(in, fileName, HEIGHT / MINGRID, BOARDWIDTH / MINGRID)) {
+            return false;
+        }
+        init(level.rows, level.cols, level.numSymbols, level.caption);
         for (int y = 0; y < rows; y++) {
             for (int x = 0; x < cols; x++) {
-                in >> c;
-                put(x, y, new box(V2(x, y), V2(1, 1), c - '0'));
+                put(x, y, new box(V2(x, y), V2(1, 1), level.colors.get(x, y)));
             }
         }
-        for (symbol& s : symbols) {
-            in >> c >> s.start.x >> s.start.y >> s.end.x >> s.end.y;
-            s.c = c - 'A';
-            s.color = at(s.start) -> color;
-        }
+        symbols = level.symbols;
         updatePath();
+        return true;
+    }
+
+    //Deep copy, so the worker can update a board while this one is still being drawn
+    boardType* clone() {
+        boardType* copy = new boardType(*this);
+        for (int x = 0; x < cols; x++) {
+            for (int y = 0; y < rows; y++) {
+                box* b = at(x, y);
+                if (b -> pos == V2(x, y)) {
+                    box* c = b -> clone();
+                    for (int cx = b -> pos.x; cx <= b -> opp.x; cx++) {
+                        for (int cy = b -> pos.y; cy <= b -> opp.y; cy++) {
+                            copy -> put(cx, cy, c);
+                        }
+                    }
+                }
+            }
+        }
+        copy -> symbolToChange = NULL;
+        for (int i = 0; i < symbols.size(); i++) {
+            if (symbolToChange == &symbols[i].start) {
+                copy -> symbolToChange = &copy -> symbols[i].start;
+            }
+            else if (symbolToChange == &symbols[i].end) {
+                copy -> symbolToChange = &copy -> symbols[i].end;
+            }
+        }
+        return copy;
     }
 
     ~boardType() {
@@ -217,13 +547,27 @@ class boardType {
         boxes[y][x] = b;
     }
 
-    V2 mouse() {
+    V2 cell(Vector2 point) {
         V2 toReturn;
-        toReturn.x = max(0, min(cols - 1, (int)GetMousePosition().x / grid));
-        toReturn.y = max(0, min(rows - 1, (int)GetMousePosition().y / grid));
+        toReturn.x = max(0, min(cols - 1, (int)point.x / grid));
+        toReturn.y = max(0, min(rows - 1, (int)point.y / grid));
         return toReturn;
     }
 
+    V2 mouse() {
+        return cell(GetMousePosition());
+    }
+
+    //Set low and high to the boxes spanned by a selection from p1 to p2
+    void select() {
+        low.x = min(p1.x, p2.x);
+        low.y = min(p1.y, p2.y);
+        high.x = max(p1.x, p2.x);
+        high.y = max(p1.y, p2.y);
+        low = at(low) -> pos;
+        high = at(high) -> opp;
+    }
+
     set<box*> adj(box* b) {
         set<box*> toReturn;
         if (b -> pos.y > 0) {
@@ -273,14 +617,20 @@ class boardType {
             }
         }
         bool won = true;
-        for (symbol& s : symbols) {
+        for (int i = 0; i < MAXSYMBOLS; i++) {
+            linked[i] = false;
+        }
+        for (int i = 0; i < symbols.size(); i++) {
+            symbol& s = symbols[i];
             if (at(s.start) -> color == s.color) {
                 at(s.start) -> path[s.c] = true;
                 set<box*> visitedBoxes;
                 visitedBoxes.insert(at(s.start));
                 visit(at(s.start), visitedBoxes);
             }
-            if (!at(s.end) -> path[s.c]) {
+            //Recorded now, since flooding from the end marks the end box either way
+            linked[i] = at(s.end) -> path[s.c];
+            if (!linked[i]) {
                 won = false;
             }
             if (at(s.end) -> color == s.color) {
@@ -293,6 +643,11 @@ class boardType {
         return won;
     }
 
+    //Whether symbols[i] was linked start to end by the last updatePath
+    bool connected(int i) {
+        return linked[i];
+    }
+
     char resultColor(V2 low, V2 high) {
         int colorCounts[NUMCOLORS] = {};
         for (int x = low.x; x <= high.x; x++) {
@@ -317,23 +672,26 @@ class boardType {
         return maxColor;
     }
 
-    bool combine(V2 low, V2 high) {
-        bool ok = true;
+    bool canCombine(V2 low, V2 high) {
         //Verify that there is more than one box in the selection
         if (at(low) -> pos == at(high) -> pos) {
-            ok = false;
+            return false;
         }
         //Verify that boxes are the same size and fit inside selection
-        for (int x = low.x; x <= high.x && ok; x++) {
-            for (int y = low.y; y <= high.y && ok; y++) {
+        for (int x = low.x; x <= high.x; x++) {
+            for (int y = low.y; y <= high.y; y++) {
                 if (at(x, y) -> dim != at(low) -> dim ||
                     at(x, y) -> pos.x < low.x || at(x, y) -> pos.y < low.y ||
                     at(x, y) -> opp.y > high.y || at(x, y) -> opp.x  > high.x) {
-                    ok = false;
-                    break;
+                    return false;
                 }
             }
         }
+        return true;
+    }
+
+    bool combine(V2 low, V2 high) {
+        bool ok = canCombine(low, high);
         if (ok) {
             box* newBox = new box(low, high - low + V2(1, 1), resultColor(low, high));
             for (int x = low.x; x <= high.x; x++) {
@@ -360,6 +718,86 @@ class boardType {
         }
     }
 
+    //Every rectangle of at least two cells and at most maxDim on a side
+    vector<moveType> candidateMoves(int maxDim) {
+        vector<moveType> moves;
+        for (int x = 0; x < cols; x++) {
+            for (int y = 0; y < rows; y++) {
+                for (int w = 1; w <= maxDim && x + w <= cols; w++) {
+                    for (int h = 1; h <= maxDim && y + h <= rows; h++) {
+                        if (w * h > 1) {
+                            moves.push_back({V2(x, y), V2(x + w - 1, y + h - 1)});
+                        }
+                    }
+                }
+            }
+        }
+        return moves;
+    }
+
+    //Evaluate a combine without touching the board. The move is a view of the board with
+    //only the combined rectangle recolored, so nothing is copied. Connectivity is found by
+    //flooding cells of equal color, which links the same boxes as updatePath does.
+    //component (rows * cols cells) and toVisit are per-thread scratch space.
+    moveResult evaluate(moveType m, vector<int>& component, vector<V2>& toVisit) {
+        moveResult result;
+        result.legal = canCombine(m.low, m.high);
+        if (!result.legal) {
+            return result;
+        }
+        result.color = resultColor(m.low, m.high);
+        auto colorAt = [&](V2 v) {
+            if (v.x >= m.low.x && v.x <= m.high.x && v.y >= m.low.y && v.y <= m.high.y) {
+                return result.color;
+            }
+            return at(v) -> color;
+        };
+        fill(component.begin(), component.end(), -1);
+        toVisit.clear();
+        result.won = true;
+        for (int i = 0; i < symbols.size(); i++) {
+            symbol& s = symbols[i];
+            if (colorAt(s.start) == s.color) {
+                if (component[s.start.y * cols + s.start.x] < 0) {
+                    component[s.start.y * cols + s.start.x] = i;
+                    toVisit.push_back(s.start);
+                    while (!toVisit.empty()) {
+                        V2 v = toVisit.back();
+                        toVisit.pop_back();
+                        for (V2 n : {V2(v.x - 1, v.y), V2(v.x + 1, v.y),
+                                     V2(v.x, v.y - 1), V2(v.x, v.y + 1)}) {
+                            if (n.x >= 0 && n.x < cols && n.y >= 0 && n.y < rows &&
+                                component[n.y * cols + n.x] < 0 && colorAt(n) == s.color) {
+                                component[n.y * cols + n.x] = i;
+                                toVisit.push_back(n);
+                            }
+                        }
+                    }
+                }
+                result.connected[i] = component[s.end.y * cols + s.end.x] ==
+                                      component[s.start.y * cols + s.start.x];
+            }
+            result.won &= result.connected[i];
+        }
+        return result;
+    }
+
+    //Evaluate many candidate combines against this position, spread across the pool in
+    //contiguous chunks, so threads don't share cache lines of results. An unstarted pool
+    //evaluates everything on the caller. The board must not change until this returns.
+    vector<moveResult> evaluateMoves(const vector<moveType>& moves, poolType& pool) {
+        vector<moveResult> results(moves.size());
+        pool.runAll([&](int index, int count) {
+            vector<int> component(rows * cols);
+            vector<V2> toVisit;
+            size_t end = moves.size() * (index + 1) / count;
+            for (size_t i = moves.size() * index / count; i < end; i++) {
+                results[i] = evaluate(moves[i], component, toVisit);
+            }
+        });
+        return results;
+    }
+
 #if not defined(PLATFORM_WEB)
     void write() {
         ofstream out;
@@ -368,35 +806,62 @@ class boardType {
             cout << "Error: level file not opened for write.\n";
         }
         else {
-            out << rows << " " << cols << " " << numSymbols << " " << "caption" << endl;
-            vector<vector<char>> colors(rows, vector<char>(cols, ' '));
+            levelType level;
+            level.rows = rows;
+            level.cols = cols;
+            level.numSymbols = numSymbols;
+            level.caption = "caption";
+            level.colors.init(rows, cols);
             for (int y = 0; y < rows; y++) {
                 for (int x = 0; x < cols; x++) {
-                    at(x, y) -> write(colors);
+                    level.colors.set(x, y, at(x, y) -> colorAt(V2(x, y)));
                 }
             }
-            for (int y = 0; y < rows; y++) {
-                for (int x = 0; x < cols; x++) {
-                    out << char('0' + colors[y][x]) << " ";
-                }
-                out << endl;
+            level.symbols = symbols;
+            level.write(out);
+        }
+    }
+#endif
+
+    //Word wrap the caption into the sidebar once, rather than every frame with DrawTextRec
+    void layoutCaption() {
+        captionLines.clear();
+        size_t paraStart = 0;
+        while (paraStart <= caption.size()) {
+            size_t paraEnd = caption.find('\n', paraStart);
+            if (paraEnd == string::npos) {
+                paraEnd = caption.size();
             }
-            for (symbol& s : symbols) {
-                out << char('A' + s.c) << " " << s.start.x << " " << s.start.y
-                    << " " << s.end.x << " " << s.end.y << endl;
+            string line;
+            size_t wordStart = paraStart;
+            while (wordStart < paraEnd) {
+                size_t wordEnd = min(caption.find(' ', wordStart), paraEnd);
+                if (wordEnd > wordStart) {
+                    string word = caption.substr(wordStart, wordEnd - wordStart);
+                    string longer = line.empty() ? word : line + " " + word;
+                    if (!line.empty() &&
+                        MeasureTextEx(GetFontDefault(), longer.c_str(), BUTTONHEIGHT, 3).x > SIDEBAR) {
+                        captionLines.push_back(line);
+                        line = word;
+                    }
+                    else {
+                        line = longer;
+                    }
+                }
+                wordStart = wordEnd + 1;
             }
+            captionLines.push_back(line);
+            paraStart = paraEnd + 1;
         }
+        captionLaidOut = true;
     }
-#endif
 
     void draw() {
-        set<box*> drawn;
         for (int x = 0; x < cols; x++) {
             for (int y = 0; y < rows; y++) {
-                //Draw boxes
+                //Draw boxes (once each, from their upper left cell)
                 box* b = at(x, y);
-                if (!drawn.count(b)) {
-                    drawn.insert(b);
+                if (b -> pos == V2(x, y)) {
                     //Draw black background (border) for boxes which are connected to a symbol
                     for (int k = 0; k < symbols.size(); k++) {
                         if (b -> path[k]) {
@@ -448,23 +913,36 @@ class boardType {
             }
         }
         //Draw caption
-        Rectangle textRec = {BOARDWIDTH, 5 * BUTTONHEIGHT, SIDEBAR, HEIGHT - 5 * BUTTONHEIGHT};
-        DrawTextRec(GetFontDefault(), caption.c_str(), textRec, BUTTONHEIGHT, 3, true, FOREGROUND);
+        if (!captionLaidOut) {
+            layoutCaption();
+        }
+        for (int i = 0; i < captionLines.size(); i++) {
+            Vector2 linePos = {BOARDWIDTH, 5 * BUTTONHEIGHT + i * (BUTTONHEIGHT + BUTTONHEIGHT / 2)};
+            DrawTextEx(GetFontDefault(), captionLines[i].c_str(), linePos, BUTTONHEIGHT, 3, FOREGROUND);
+        }
 //        DrawText(display.c_str(), 0, rows * grid + space, 16, FOREGROUND);
     }
 
-    bool update() {
-        //Return true if won
-        if (IsMouseButtonPressed(MOUSE_RIGHT_BUTTON)) {
-            p1 = mouse();
+    //Apply a recorded click: right press/release selects and combines, left press splits.
+    //Return true if the path must be recomputed (see updatePath)
+    bool click(clickType c) {
+        if (c.button == MOUSE_RIGHT_BUTTON && c.pressed) {
+            p1 = cell(c.at);
+            return false;
         }
+        else if (c.button == MOUSE_RIGHT_BUTTON) {
+            p2 = cell(c.at);
+            select();
+            return combine(low, high);
+        }
+        split(cell(c.at));
+        return true;
+    }
+
+    bool update() {
+        //Return true if the path must be recomputed (see updatePath)
         p2 = mouse();
-        low.x = min(p1.x, p2.x);
-        low.y = min(p1.y, p2.y);
-        high.x = max(p1.x, p2.x);
-        high.y = max(p1.y, p2.y);
-        low = at(low) -> pos;
-        high = at(high) -> opp;
+        select();
 
         bool mustUpdatePath = false;
         //Allow for editing/saving levels (desktop only)
@@ -513,22 +991,12 @@ class boardType {
             DrawRectangle(low.x * grid + space, low.y * grid + space,
                           dim.x * grid - space, dim.y * grid - space, HIGHLIGHT);
         }
-        if (IsMouseButtonReleased(MOUSE_RIGHT_BUTTON)) {
-            mustUpdatePath = combine(low, high);
-        }
-        if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON) && GetMousePosition().x < BOARDWIDTH) {
-            split(mouse());
-            mustUpdatePath = true;
-        }
-        if (mustUpdatePath) {
-            return updatePath();
-        }
-        return false;
+        return mustUpdatePath;
     }
 };
 
-bool button(int y, string text, int x = 0, int xDivisions = 1, bool highlight = false) {
-    int textWidth = MeasureText(text.c_str(), BUTTONHEIGHT);
+bool button(int y, label& text, int x = 0, int xDivisions = 1, bool highlight = false) {
+    int textWidth = text.measure();
     Vector2 upperRight = {(x + 1) * WIDTH / (xDivisions + 1) - textWidth / 2, y};
     Vector2 lowerLeft = {(x + 1) * WIDTH / (xDivisions + 1) + textWidth / 2, y + BUTTONHEIGHT};
     Vector2 mouse = GetMousePosition();
@@ -537,37 +1005,152 @@ bool button(int y, string text, int x = 0, int xDivisions = 1, bool highlight =
          mouse.y > upperRight.y && mouse.y < lowerLeft.y)) {
         DrawRectangle(upperRight.x - BUTTONMARGIN, upperRight.y - BUTTONMARGIN,
                       textWidth + 2 * BUTTONMARGIN, BUTTONHEIGHT + 2 * BUTTONMARGIN, FOREGROUND);
-        DrawText(text.c_str(), upperRight.x, upperRight.y, BUTTONHEIGHT, BACKGROUND);
+        DrawText(text.text.c_str(), upperRight.x, upperRight.y, BUTTONHEIGHT, BACKGROUND);
         return IsMouseButtonPressed(MOUSE_LEFT_BUTTON) || IsMouseButtonPressed(MOUSE_RIGHT_BUTTON);
     }
     else {
-        DrawText(text.c_str(), upperRight.x, upperRight.y, BUTTONHEIGHT, FOREGROUND);
+        DrawText(text.text.c_str(), upperRight.x, upperRight.y, BUTTONHEIGHT, FOREGROUND);
         return false;
     }
 }
 
+//Runs board computation (loading, generation, connectivity) off the main thread, so
+//the main loop only renders and forwards input. Without threads, jobs run inline.
+class workerType {
+
+    function<void()> job;
+    bool busy = false;
+    bool quit = false;
+#if defined(HAS_THREADS)
+    thread worker;
+    mutex m;
+    condition_variable cv;
+
+    void run() {
+        unique_lock<mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [this] {return quit || job;});
+            if (!job) {
+                return;
+            }
+            function<void()> current = move(job);
+            job = nullptr;
+            lock.unlock();
+            current();
+            lock.lock();
+            busy = false;
+            cv.notify_all();
+        }
+    }
+#endif
+
+    public:
+
+    void start() {
+    #if defined(HAS_THREADS)
+        worker = thread(&workerType::run, this);
+    #endif
+    }
+
+    //Queue this job unless one is already running. The main loop uses this, since
+    //blocking there would freeze rendering for as long as the running job takes
+    bool trySubmit(function<void()> newJob) {
+    #if defined(HAS_THREADS)
+        lock_guard<mutex> lock(m);
+        if (busy) {
+            return false;
+        }
+        job = move(newJob);
+        busy = true;
+        cv.notify_all();
+    #else
+        newJob();
+    #endif
+        return true;
+    }
+
+    //Wait for any previous job, then queue this one
+    void submit(function<void()> newJob) {
+    #if defined(HAS_THREADS)
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [this] {return !busy;});
+        job = move(newJob);
+        busy = true;
+        cv.notify_all();
+    #else
+        newJob();
+    #endif
+    }
+
+    //The board may only be touched from the main thread while the worker is idle
+    bool idle() {
+    #if defined(HAS_THREADS)
+        lock_guard<mutex> lock(m);
+    #endif
+        return !busy;
+    }
+
+    void wait() {
+    #if defined(HAS_THREADS)
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [this] {return !busy;});
+    #endif
+    }
+
+    void stop() {
+    #if defined(HAS_THREADS)
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+            cv.notify_all();
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+    #endif
+    }
+};
+
 struct mainData {
 
     enum states{menu, play};
     int state = menu;
 
-    boardType board;
+    //The main loop draws board; the worker builds into next, which is swapped in when done
+    boardType* board = new boardType();
+    boardType* next = NULL;
+    bool nextWon = false;
+    bool loading = false;
+    workerType worker;
+    poolType pool;
+    vector<clickType> clicks;
 
     bool won = false;
+    bool loadFailed = false;    //Set by the worker, read by the main loop once it is idle
+    string loadingName;
 
-    vector<vector<string>> levels;
+    vector<vector<label>> levels;
     int currentLevel = 0;
-    const string tabNames[5] = {"tutorial", "easy", "medium", "hard", "generate"};
+    label tabNames[5] = {"tutorial", "easy", "medium", "hard", "generate"};
     int menuTab = 0;
 
     const string paramNames[4] = {"rows", "columns", "symbols", "seed"};
+    label paramLabels[4];
     unsigned int params[4] = {24, 24, 4, 0};
     const unsigned int maxParams[4] = {HEIGHT / MINGRID, BOARDWIDTH / MINGRID, MAXSYMBOLS, 0xffffffff};
     const unsigned int minParams[4] = {4, 4, 1, 0};
     int paramSelect = 0;
 
+    label warning = "Warning: some random levels may be impossible.";
+    label randomSeedLabel = "Random seed";
+    label doneLabel = "Done";
+    label menuLabel = "menu";
+    label continueLabel = "continue";
+    label workingLabel = "working...";
+    label errorLabel;
+
 void readLevels() {
-    levels = vector<vector<string>>(4, vector<string>());
+    levels = vector<vector<label>>(4, vector<label>());
     fstream list;
     list.open("resources/levels");
     if (!list) {
@@ -588,11 +1171,222 @@ void readLevels() {
     list.close();
 }
 
+//Return false if the worker is still busy with the previous job
+bool loadLevel(string levelName) {
+    bool accepted = worker.trySubmit([this, levelName] {
+        next = new boardType();
+        loadFailed = !next -> read(levelName);
+        if (loadFailed) {
+            delete next;
+            next = NULL;
+        }
+    });
+    if (accepted) {
+        clicks.clear();
+        loadingName = levelName;
+        loading = true;
+    }
+    return accepted;
+}
+
+//Return false if the worker is still busy with the previous job
+bool generateLevel(unsigned int seed, int newRows, int newCols, int newSymbols, string caption) {
+    bool accepted = worker.trySubmit([this, seed, newRows, newCols, newSymbols, caption] {
+        srand(seed);
+        next = new boardType();
+        next -> generate(newRows, newCols, newSymbols, caption);
+    });
+    if (accepted) {
+        clicks.clear();
+        loading = true;
+    }
+    return accepted;
+}
+
+//Swap in the board the worker finished, if any. Call only while the worker is idle
+void finishJob() {
+    if (next != NULL) {
+        delete board;
+        board = next;
+        next = NULL;
+        if (loading) {
+            won = false;
+        }
+        else {
+            won |= nextWon;
+        }
+    }
+    loading = false;
+}
+
+#if defined(BOXES_HEADLESS)
+//Batch evaluate small moves on the loaded board, and compare against playing each one
+bool checkMoves(string name) {
+    won = board -> updatePath();
+    vector<moveType> moves = board -> candidateMoves(3);
+    vector<moveResult> results = board -> evaluateMoves(moves, pool);
+    int legal = 0, winning = 0, mismatched = 0;
+    for (int i = 0; i < moves.size(); i++) {
+        moveType& m = moves[i];
+        if (board -> combine(m.low, m.high) != results[i].legal) {
+            mismatched++;
+        }
+        else if (results[i].legal) {
+            bool moveWins = board -> updatePath();
+            bool sameLinks = true;
+            for (int k = 0; k < MAXSYMBOLS; k++) {
+                sameLinks &= board -> connected(k) == results[i].connected[k];
+            }
+            if (board -> at(m.low) -> color != results[i].color || moveWins != results[i].won ||
+                !sameLinks) {
+                mismatched++;
+            }
+            legal++;
+            winning += moveWins;
+            board -> split(m.low);
+        }
+    }
+    board -> updatePath();
+    cout << name << ": " << (won ? "connected" : "unconnected") << ", " << legal
+         << " legal moves, " << winning << " winning";
+    if (mismatched > 0) {
+        cout << ", " << mismatched << " MISMATCHED";
+    }
+    cout << endl;
+    return mismatched == 0;
+}
+
+//Level files must read back to exactly what was written
+bool checkRoundTrip(string levelName) {
+    ifstream in("resources/" + levelName);
+    levelType level, reread;
+    stringstream written, rewritten;
+    if (!level.read(in, levelName)) {
+        return false;
+    }
+    level.write(written);
+    if (!reread.read(written, levelName + " (rewritten)")) {
+        return false;
+    }
+    reread.write(rewritten);
+    return written.str() == rewritten.str();
+}
+
+//Moves evaluated per second on the loaded board
+double evaluationRate(vector<moveType>& moves, poolType& evaluators) {
+    auto start = chrono::steady_clock::now();
+    chrono::duration<double> elapsed(0);
+    size_t evaluated = 0;
+    while (elapsed.count() < 0.25) {
+        board -> evaluateMoves(moves, evaluators);
+        evaluated += moves.size();
+        elapsed = chrono::steady_clock::now() - start;
+    }
+    return evaluated / elapsed.count();
+}
+
+//Connectivity found on the worker must match running updatePath inline, and on a clone
+bool checkInline(string name) {
+    boardType* copy = board -> clone();
+    bool cloneWon = copy -> updatePath();
+    delete copy;
+    if (board -> updatePath() != won || cloneWon != won) {
+        cout << name << ": worker and inline connectivity differ" << endl;
+        return false;
+    }
+    return true;
+}
+
+//Load every level on the worker and check batch move evaluation, without a window
+bool check() {
+    bool ok = true;
+    stringstream malformed("2 2 1 caption\n1 1\n1 9\nA 0 0 1 1\n");
+    levelType rejected;
+    cout << "expecting an error at malformed:3" << endl;
+    ok &= !rejected.read(malformed, "malformed");
+    stringstream huge("2000000000 2000000000 1\n");
+    cout << "expecting an error at huge:1" << endl;
+    ok &= !rejected.read(huge, "huge");
+    stringstream unspaced;
+    levelType captioned;
+    captioned.rows = captioned.cols = 1;
+    captioned.caption = "foo";
+    captioned.colors.init(1, 1);
+    captioned.write(unspaced);
+    ok &= rejected.read(unspaced, "unspaced") && rejected.caption == "foo";
+    stringstream multiline;
+    captioned.caption = "rows: 1\ncols: 1\n";
+    captioned.write(multiline);
+    ok &= rejected.read(multiline, "multiline") && rejected.caption == "rows: 1 cols: 1 ";
+    for (int tab = 0; tab < levels.size(); tab++) {
+        for (label& levelName : levels[tab]) {
+            ok &= checkRoundTrip(levelName.text);
+        }
+    }
+    worker.start();
+    pool.start(EVALUATORS - 1);
+    for (int tab = 0; tab < levels.size(); tab++) {
+        for (label& levelName : levels[tab]) {
+            worker.wait();
+            ok &= loadLevel(levelName.text);
+            worker.wait();
+            finishJob();
+            if (loadFailed) {
+                ok = false;
+                continue;
+            }
+            string name = tabNames[tab].text + "/" + levelName.text;
+            bool movesOk = false;
+            worker.submit([this, name, &movesOk] {movesOk = checkMoves(name);});
+            worker.wait();
+            ok &= movesOk && checkInline(name);
+        }
+    }
+    for (unsigned int seed : {0, 1, 2}) {
+        string name = "generate/" + to_string(seed);
+        bool movesOk = false;
+        worker.wait();
+        ok &= generateLevel(seed, DEFAULTROWS, DEFAULTCOLS, DEFAULTSYMBOLS, "generated");
+        worker.wait();
+        finishJob();
+        worker.submit([this, name, &movesOk] {movesOk = checkMoves(name);});
+        worker.wait();
+        ok &= movesOk && checkInline(name);
+    }
+    //Batch throughput on the last generated board, on one thread and across the pool
+    worker.submit([this] {
+        vector<moveType> moves = board -> candidateMoves(6);
+        poolType single;
+        double singleRate = evaluationRate(moves, single);
+        double poolRate = evaluationRate(moves, pool);
+        cout << "evaluateMoves: " << (int)singleRate << " moves/s on 1 thread, "
+             << (int)poolRate << " on " << pool.size() << " (" << poolRate / singleRate
+             << "x)" << endl;
+    });
+    worker.wait();
+    worker.stop();
+    pool.stop();
+    return ok;
+}
+#endif
+
 void mainLoop() {
     BeginDrawing();
     ClearBackground(BACKGROUND);
 
+    //A level which failed to load on the worker sends us back to the menu
+    if (state == play && worker.idle() && loadFailed) {
+        loadFailed = false;
+        loading = false;
+        errorLabel.set(("Could not load level " + loadingName).c_str());
+        state = menu;
+    }
+
     if (state == menu) {
+        if (!errorLabel.text.empty()) {
+            DrawText(errorLabel.text.c_str(), (WIDTH - errorLabel.measure()) / 2,
+                     HEIGHT - 2 * BUTTONHEIGHT, BUTTONHEIGHT, (Color){255, 0, 0, 255});
+        }
         for (int i = 0; i < 5; i++) {
             if (button(BUTTONHEIGHT, tabNames[i], i, 5, i == menuTab)) {
                 menuTab = i;
@@ -605,13 +1399,11 @@ void mainLoop() {
                     if (levelIndex == levels[menuTab].size()) {
                         break;
                     }
-                    string levelName = levels[menuTab][levelIndex];
-                    if (button(row, levelName, col, 3, false)) {
-                        board = boardType();
-                        board.read(levelName);
+                    label& levelName = levels[menuTab][levelIndex];
+                    if (button(row, levelName, col, 3, false) && loadLevel(levelName.text)) {
+                        errorLabel.set("");
                         currentLevel = levelIndex;
                         state = play;
-                        won = false;
                     }
                     levelIndex++;
                 }
@@ -621,17 +1413,18 @@ void mainLoop() {
             }
         }
         else {
-            string warning = "Warning: some random levels may be impossible.";
-            int warningWidth = MeasureText(warning.c_str(), BUTTONHEIGHT);
-            DrawText(warning.c_str(), (WIDTH - warningWidth) / 2, 3 * BUTTONHEIGHT,
+            DrawText(warning.text.c_str(), (WIDTH - warning.measure()) / 2, 3 * BUTTONHEIGHT,
                      BUTTONHEIGHT, (Color){255, 0, 0, 255});
             for (int x : {0, 1}) {
                 for (int y : {0, 1}) {
                     int i = 2 * x + y;
                     bool selected = (i == paramSelect);
-                    if (button((5 + 2 * y) * BUTTONHEIGHT,
-                        paramNames[i] + ": " + to_string(params[i]) + (selected ? "_" : ""),
-                        x, 2, selected)) {
+                    //Formatted on the stack; the label only rebuilds if the text changed
+                    char paramText[32];
+                    snprintf(paramText, sizeof(paramText), "%s: %u%s",
+                             paramNames[i].c_str(), params[i], selected ? "_" : "");
+                    paramLabels[i].set(paramText);
+                    if (button((5 + 2 * y) * BUTTONHEIGHT, paramLabels[i], x, 2, selected)) {
                         params[paramSelect] = min(maxParams[paramSelect], params[paramSelect]);
                         params[paramSelect] = max(minParams[paramSelect], params[paramSelect]);
                         params[2] = min(params[2], params[0] * params[1] / 8);
@@ -647,43 +1440,78 @@ void mainLoop() {
             if (IsKeyPressed(KEY_BACKSPACE)) {
                 params[paramSelect] /= 10;
             }
-            if (button(9 * BUTTONHEIGHT, "Random seed")) {
+            if (button(9 * BUTTONHEIGHT, randomSeedLabel)) {
                 srand(time(NULL));
                 params[3] = rand();
             }
-            if (button(11 * BUTTONHEIGHT, "Done")) {
+            if (button(11 * BUTTONHEIGHT, doneLabel) && worker.idle()) {
                 string caption = "rows: " + to_string(params[0]) +
                                  "\ncols: " + to_string(params[1]) +
                                  "\nsymbols: " + to_string(params[2]) +
                                  "\nseed: " + to_string(params[3]) + "\n";
                 cout << caption;
-                srand(params[3]);
-                board.generate(params[0], params[1], params[2], caption);
-                state = play;
-                won = false;
+                if (generateLevel(params[3], params[0], params[1], params[2], caption)) {
+                    state = play;
+                }
             }
         }
     }
     else if (state == play) {
-        board.draw();
-        won |= board.update();
-        if (button(BUTTONHEIGHT, "menu", 6, 7)) {
+        //Record clicks every frame, so that none are lost while the worker is busy
+        Vector2 mouse = GetMousePosition();
+        if (IsMouseButtonPressed(MOUSE_RIGHT_BUTTON)) {
+            clicks.push_back({MOUSE_RIGHT_BUTTON, true, mouse});
+        }
+        if (IsMouseButtonReleased(MOUSE_RIGHT_BUTTON)) {
+            clicks.push_back({MOUSE_RIGHT_BUTTON, false, mouse});
+        }
+        if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON) && mouse.x < BOARDWIDTH) {
+            clicks.push_back({MOUSE_LEFT_BUTTON, true, mouse});
+        }
+        //The board is always drawn; while a job runs it is the last finished one
+        bool ready = worker.idle();
+        if (ready) {
+            finishJob();
+        }
+        board -> draw();
+        if (ready) {
+            bool mustUpdatePath = false;
+            for (clickType& c : clicks) {
+                mustUpdatePath |= board -> click(c);
+            }
+            clicks.clear();
+            mustUpdatePath |= board -> update();
+            if (mustUpdatePath) {
+                boardType* copy = board -> clone();
+                if (worker.trySubmit([this, copy] {
+                        nextWon = copy -> updatePath();
+                        next = copy;
+                    })) {
+                    ready = false;
+                }
+                else {
+                    delete copy;
+                }
+            }
+        }
+        else if (loading) {
+            DrawText(workingLabel.text.c_str(), (BOARDWIDTH - workingLabel.measure()) / 2,
+                     (HEIGHT - BUTTONHEIGHT) / 2, BUTTONHEIGHT, FOREGROUND);
+        }
+        if (button(BUTTONHEIGHT, menuLabel, 6, 7)) {
+            clicks.clear();
             state = menu;
         }
-        if (won && button(3 * BUTTONHEIGHT, "continue", 6, 7)) {
+        if (ready && won && button(3 * BUTTONHEIGHT, continueLabel, 6, 7)) {
             if (menuTab < 4) {
                 if (currentLevel < levels[menuTab].size() - 1) {
                     currentLevel++;
-                    board = boardType();
-                    board.read(levels[menuTab][currentLevel]);
-                    won = false;
+                    loadLevel(levels[menuTab][currentLevel].text);
                 }
                 else if (menuTab < 3) {
                     menuTab++;
                     currentLevel = 0;
-                    board = boardType();
-                    board.read(levels[menuTab][currentLevel]);
-                    won = false;
+                    loadLevel(levels[menuTab][currentLevel].text);
                 }
                 else {
                     state = menu;
@@ -705,6 +1533,13 @@ void mainLoop() {
 };
 
 static mainData everything;
+
+#if defined(BOXES_HEADLESS)
+int main() {
+    everything.readLevels();
+    return everything.check() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#else
 static void mainLoop() {
     everything.mainLoop();
 }
@@ -713,6 +1548,7 @@ int main() {
 
     InitWindow(WIDTH, HEIGHT, "Boxes");
     everything.readLevels();
+    everything.worker.start();
 
 #if defined(PLATFORM_WEB)
     emscripten_set_main_loop(mainLoop, 60, 1);
@@ -721,8 +1557,10 @@ int main() {
     while (!WindowShouldClose()) {
         everything.mainLoop();
     }
+    everything.worker.stop();
 #endif
 }
+#endif
 
 
 